@@ -2,29 +2,160 @@
 
 #include "pico/stdlib.h"
 #include "hardware/pwm.h"
+#include "hardware/sync.h"
+#include "hardware/flash.h"
+#include <string.h>
 
 #include "Stepper.h"
 
 
 
+// The plunger position is kept in the last sector of flash, so that it survives power cycles and resets.
+// Each save is written to the next page of the sector, so the sector only needs erasing once every page is used.
+// The program must not grow into this sector.
+#define POSITION_FLASH_OFFSET (PICO_FLASH_SIZE_BYTES - FLASH_SECTOR_SIZE)
+#define POSITION_RECORDS ((int)(FLASH_SECTOR_SIZE / FLASH_PAGE_SIZE))
+#define POSITION_MAGIC 0x504c4e47  // "PLNG"
+#define POSITION_STOPPED 0xFFFFFFFF  // Erased value of the "moving" word. Programmed to 0 when a move starts.
+
+// Layout of a saved position at the start of a flash page.
+struct position_record
+{
+    uint32_t magic;
+    int32_t position;
+    uint32_t moving;
+};
+
+// Counter wrap value used when moving freely (forward() and backward()), giving the largest count before wrapping.
+#define FREE_RUN_WRAP 65535
+
+
 // Global variables to store PWM slice numbers so that they can be used in the interrupt handler bellow.
 uint slice_num_global;
 uint slice_num_counter_global;
 
+// Global variables to keep track of the absolute plunger position (in steps, forwards is positive).
+// These are shared with the interrupt handler bellow, so are kept as globals like the slice numbers above.
+volatile int32_t position_global = 0;
+volatile int32_t direction_global = 1;       // +1 when moving forwards, -1 when moving backwards.
+volatile bool bounded_move_global = false;   // True during forward_by() and backward_by() moves.
+volatile bool position_valid_global = false; // False until the position is restored or set with set_position().
 
-// Interrupt handler for use by Stepper class.
-void on_pwm_wrap(void)
+// Global variables to keep track of the last position record written to flash.
+int position_record_global = -1;             // Page of the last record in the sector, or -1 if there is none.
+int32_t position_record_value_global = 0;
+bool position_record_moving_global = false;
+
+
+// Return the position record stored in the given page of the flash sector.
+static const position_record *read_position_record(int page)
+{
+    return (const position_record *)(XIP_BASE + POSITION_FLASH_OFFSET + page * FLASH_PAGE_SIZE);
+}
+
+
+// Program a position record into the given page of the flash sector.
+// Bits can only be cleared without an erase, so a page can only be re-programmed to set "moving".
+static void write_position_record(int page, int32_t position, uint32_t moving)
+{
+    uint8_t data[FLASH_PAGE_SIZE];
+    memset(data, 0xFF, sizeof(data));
+    position_record record = { POSITION_MAGIC, position, moving };
+    memcpy(data, &record, sizeof(record));
+
+    // Interrupts must be disabled while flash is being written, since code can't be run from flash at the same time.
+    uint32_t status = save_and_disable_interrupts();
+    flash_range_program(POSITION_FLASH_OFFSET + page * FLASH_PAGE_SIZE, data, FLASH_PAGE_SIZE);
+    restore_interrupts(status);
+}
+
+
+// Store the current position in flash, so that it survives power cycles and resets.
+// Nothing is stored while the position is unknown, so an unknown position is never restored as a known one.
+// Nothing is written either if the position stored is already up to date.
+static void save_position(void)
 {
-    // Disable step PWM output and counter PWM input.
-    pwm_set_enabled(slice_num_global, false);
-    pwm_set_enabled(slice_num_counter_global, false);
-    // Ensure counter is reset to 0 in the counter PWM.
+    if (!position_valid_global) {
+        return;
+    }
+    if (position_record_global >= 0 && !position_record_moving_global && position_record_value_global == position_global) {
+        return;
+    }
+
+    // Move on to the next page, erasing the sector if it is full or has never been used for records.
+    if (position_record_global < 0 || position_record_global + 1 >= POSITION_RECORDS) {
+        uint32_t status = save_and_disable_interrupts();
+        flash_range_erase(POSITION_FLASH_OFFSET, FLASH_SECTOR_SIZE);
+        restore_interrupts(status);
+        position_record_global = 0;
+    } else {
+        position_record_global++;
+    }
+
+    write_position_record(position_record_global, position_global, POSITION_STOPPED);
+    position_record_value_global = position_global;
+    position_record_moving_global = false;
+}
+
+
+// Mark the stored position as unknown while a move is in progress, since it will be out of date until the move stops.
+// A reset or power cut part way through a move then leaves the position unknown, rather than restoring the old one.
+static void clear_saved_position(void)
+{
+    if (position_record_global < 0 || position_record_moving_global) {
+        return;
+    }
+    write_position_record(position_record_global, position_record_value_global, 0);
+    position_record_moving_global = true;
+}
+
+
+// Add any steps counted so far by the counter PWM onto the position, and reset the counter to 0.
+// Must be called with interrupts disabled, or from the interrupt handler.
+static void accumulate_position(void)
+{
+    position_global += direction_global * (int32_t)pwm_get_counter(slice_num_counter_global);
     pwm_set_counter(slice_num_counter_global, 0);
+}
+
+
+// Handle a wrap of the counter PWM, if one is pending, by adding the "wrap + 1" steps it counted onto the position.
+// This is used by the interrupt handler bellow, and also by any method that changes the counter or reads the position,
+// so that a wrap which has happened but not yet been handled is accounted for with the direction it happened in.
+// Must be called with interrupts disabled, or from the interrupt handler.
+static void handle_pending_wrap(void)
+{
+    if (!(pwm_get_irq_status_mask() & (1u << slice_num_counter_global))) {
+        return;
+    }
+
+    position_global += direction_global * (int32_t)(pwm_hw->slice[slice_num_counter_global].top + 1);
+
+    if (bounded_move_global) {
+        // Disable step PWM output and counter PWM input.
+        pwm_set_enabled(slice_num_global, false);
+        pwm_set_enabled(slice_num_counter_global, false);
+        bounded_move_global = false;
+        // Ensure counter is reset to 0 in the counter PWM, and store the position now the move has stopped.
+        accumulate_position();
+        save_position();
+    } else {
+        // Ensure counter is reset to 0 in the counter PWM. Any step counted after the wrap is kept, for free movement.
+        accumulate_position();
+    }
     // Clear interrupt flag.
     pwm_clear_irq(slice_num_counter_global);
 }
 
 
+// Interrupt handler for use by Stepper class.
+// The wrap may already have been handled by a method with interrupts disabled, in which case this does nothing.
+void on_pwm_wrap(void)
+{
+    handle_pending_wrap();
+}
+
+
 // Constructor will take stepper frequency, and gpio ID numbers that are used to interface with the driver.
 // These will be used to initalise the appropriate pins as digital and PWM outputs, for control of the driver.
 Stepper::Stepper(uint step_freq, uint enable_port, uint reset_port, uint sleep_port, uint step_port, 
@@ -77,6 +208,7 @@ Stepper::Stepper(uint step_freq, uint enable_port, uint reset_port, uint sleep_p
     // Set up port as PWM input to count the pulses from the above PWM output.
     // This will be used to trigger an interrupt to stop the PWM output once a certain number of pulses are counted,
     // when using the forward_by() and backward_by() methods.
+    // It is also left counting during forward() and backward(), so that every step is added to the plunger position.
 
     // Make sure counter pin is on channel B of PWM slice and not on the same slice as the step PWM.
     assert(pwm_gpio_to_channel(counter_port) == PWM_CHAN_B);
@@ -103,6 +235,28 @@ Stepper::Stepper(uint step_freq, uint enable_port, uint reset_port, uint sleep_p
     gpio_set_function(counter_port, GPIO_FUNC_PWM);
 
 
+    // --------------- Position Tracking ---------------
+    // Restore the plunger position from the last record saved in flash, if there is one and it was not part way through a move.
+    // Otherwise the position is unknown until set_position() is called.
+    position_record_global = -1;
+    while (position_record_global + 1 < POSITION_RECORDS && read_position_record(position_record_global + 1)->magic == POSITION_MAGIC) {
+        position_record_global++;
+    }
+
+    if (position_record_global >= 0) {
+        const position_record *record = read_position_record(position_record_global);
+        position_record_value_global = record->position;
+        position_record_moving_global = record->moving != POSITION_STOPPED;
+    }
+
+    if (position_record_global >= 0 && !position_record_moving_global) {
+        position_global = position_record_value_global;
+        position_valid_global = true;
+    } else {
+        position_global = 0;
+        position_valid_global = false;
+    }
+
 
     // --------------- Enable Control ---------------
     // Set up the enable pin as a digital output. Default to output high to disable the driver.
@@ -148,46 +302,108 @@ Stepper::Stepper(uint step_freq, uint enable_port, uint reset_port, uint sleep_p
 }
 
 
+// The start_move() method will set the direction, then start the counter and step PWMs.
+// A wrap value of FREE_RUN_WRAP is used for free movement, otherwise the move stops after "wrap + 1" steps.
+// Nothing is started while the driver is disabled, since the motor would not move but the steps would still be counted.
+void Stepper::start_move(bool backwards, uint16_t wrap, bool bounded)
+{
+    if (!isEnabled) {
+        return;
+    }
+
+    uint32_t status = save_and_disable_interrupts();
+
+    // Stop the step PWM and add on any steps made so far, before changing direction.
+    pwm_set_enabled(slice_num, false);
+    handle_pending_wrap();
+    accumulate_position();
+    clear_saved_position();
+
+    gpio_put(dir, backwards);
+    direction_global = backwards ? -1 : 1;
+    bounded_move_global = bounded;
+    pwm_set_wrap(slice_num_counter, wrap);
+    pwm_set_enabled(slice_num_counter, true);
+    pwm_set_enabled(slice_num, true);
+
+    restore_interrupts(status);
+}
+
+
 // The forward() method will set the direction and step PWM pins to move the actuator forwards.
 void Stepper::forward(void)
 {
-    gpio_put(dir, 0);
-    pwm_set_enabled(slice_num, true);
+    start_move(false, FREE_RUN_WRAP, false);
 }
 
 
 // The backward() method will set the direction and step PWM pins to move the actuator backwards.
 void Stepper::backward(void)
 {
-    gpio_put(dir, 1);
-    pwm_set_enabled(slice_num, true);
+    start_move(true, FREE_RUN_WRAP, false);
 }
 
 
-// The stop() method will disable the PWM output to stop the actuator.
+// The stop() method will disable the PWM output to stop the actuator, add the steps made onto the position and store it.
 void Stepper::stop(void)
 {
+    uint32_t status = save_and_disable_interrupts();
+
     pwm_set_enabled(slice_num, false);
+    handle_pending_wrap();
+    pwm_set_enabled(slice_num_counter, false);
+    bounded_move_global = false;
+    accumulate_position();
+    save_position();
+
+    restore_interrupts(status);
 }
 
 
 // The forward_by() method will move actuator forwards by a specified number of steps.
 void Stepper::forward_by(uint steps)
 {
-    gpio_put(dir, 0);
-    pwm_set_wrap(slice_num_counter, steps-1);
-    pwm_set_enabled(slice_num_counter, true);
-    pwm_set_enabled(slice_num, true);
+    start_move(false, steps-1, true);
 }
 
 
 // The backward_by() method will move actuator backward by a specified number of steps.
 void Stepper::backward_by(uint steps)
 {
-    gpio_put(dir, 1);
-    pwm_set_wrap(slice_num_counter, steps-1);
-    pwm_set_enabled(slice_num_counter, true);
-    pwm_set_enabled(slice_num, true);
+    start_move(true, steps-1, true);
+}
+
+
+// The get_position() method will return the absolute plunger position in steps, including any move in progress.
+int32_t Stepper::get_position(void)
+{
+    uint32_t status = save_and_disable_interrupts();
+    handle_pending_wrap();
+    int32_t position = position_global + direction_global * (int32_t)pwm_get_counter(slice_num_counter);
+    restore_interrupts(status);
+    return position;
+}
+
+
+// The set_position() method will set the absolute plunger position, e.g. to zero it after refilling the syringe.
+void Stepper::set_position(int32_t position)
+{
+    uint32_t status = save_and_disable_interrupts();
+    handle_pending_wrap();
+    position_global = position - direction_global * (int32_t)pwm_get_counter(slice_num_counter);
+    position_valid_global = true;
+    // Only store the position if the actuator is stopped, otherwise it is stored when the move stops.
+    if (!(pwm_hw->slice[slice_num].csr & PWM_CH0_CSR_EN_BITS)) {
+        save_position();
+    }
+    restore_interrupts(status);
+}
+
+
+// The is_position_valid() method will return if the position is known, i.e. restored or set with set_position().
+bool Stepper::is_position_valid(void)
+{
+    return position_valid_global;
 }
 
 
@@ -199,9 +415,10 @@ void Stepper::enable(void)
 }
 
 
-// The disable() method will disable the driver.
+// The disable() method will stop any move in progress and disable the driver.
 void Stepper::disable(void)
 {
+    stop();
     gpio_put(enable_port, 1);  // Enable port is inactive high
     isEnabled = false;
 }
@@ -19,6 +19,8 @@ class Stepper
     uint slice_num;
     uint slice_num_counter;
     uint counter;
+    // Method to set the direction and start the step PWM, with the counter PWM wrapping after "wrap + 1" steps.
+    void start_move(bool, uint16_t, bool);
 public:
     // Constructor will take stepper frequency, and gpio ID numbers that are used to interface with the driver.
     Stepper(uint, uint, uint, uint, uint, uint, uint, uint, uint, uint);
@@ -32,6 +34,12 @@ public:
     void forward_by(uint);
     // Method to move actuator backwards by a specified number of steps.
     void backward_by(uint);
+    // Method to return the absolute plunger position in steps (forwards is positive).
+    int32_t get_position(void);
+    // Method to set the absolute plunger position in steps.
+    void set_position(int32_t);
+    // Method to return if the absolute plunger position is known.
+    bool is_position_valid(void);
     // Method to enable the driver.
     void enable(void);
     // Method to disable the driver.
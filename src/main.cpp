@@ -41,10 +41,18 @@
 #define X_OFFSET -3750
 #define Y_OFFSET 0
 
+#define DISPENSE_STEPS 15      // Plunger steps used to apply paste to a single pad.
+#define SYRINGE_STEPS 3000     // Plunger steps from a full syringe (position 0) to an empty one. Calibrate for the syringe used.
+
+#define NUM_PADS (sizeof(xy_coords)/sizeof(xy_coords[0]))
+
 bool z_arm_in_position = true;
 bool xy_arm_in_position = true;
 bool currently_master = true;  // Set true for testing/demo. Should be false when properly set up.
 bool start = false;
+uint next_pad = 0;  // Index of the next pad to apply paste to, so a paused job can be resumed.
+volatile bool job_running = false;  // True while paste is being applied to the pads.
+volatile bool paused = false;  // True while a job is paused, waiting to be resumed or aborted.
 
 
 // Initalise stepper control object.
@@ -80,6 +88,20 @@ void i2c0_irq_handler()
 }
 
 
+// Function to return the number of plunger steps left in the syringe.
+int remaining_steps(void)
+{
+    return SYRINGE_STEPS - stepper.get_position();
+}
+
+
+// Function to return the number of plunger steps needed to apply paste to the pads not yet done.
+int required_steps(void)
+{
+    return (NUM_PADS - next_pad) * DISPENSE_STEPS;
+}
+
+
 // Create callback function that will handle interupts from GPIO button inputs.
 void gpio_callback(uint gpio, uint32_t events)
 {
@@ -99,6 +121,7 @@ void gpio_callback(uint gpio, uint32_t events)
         printf("Pressing button 3 to start our process\n");
         if (currently_master && stepper.is_enabled()) { // Should only be able to start if we have already been given mastership and stepper is enabled
             printf("Start flag set.\n");
+            paused = false;
             gpio_put(LED1_PIN, 1);
             gpio_put(LED2_PIN, 0);
             start = true;
@@ -110,7 +133,29 @@ void gpio_callback(uint gpio, uint32_t events)
             printf("Connot start! We are not master and the stepper is not enabled!\n");
         }
     } else if (gpio == MISC_BUTTON && events == GPIO_IRQ_EDGE_RISE) {
-        if (stepper.is_enabled()) {
+        if (!stepper.is_enabled() && gpio_get(B_BUTTON)) {
+            // Pressing MISC while holding B, with the stepper disabled, marks the syringe as refilled and zeroes the position.
+            // B does not move the plunger while the stepper is disabled, so the zero point is where the plunger was left.
+            if (job_running) {
+                printf("Connot zero plunger position while a job is running!\n");
+            } else {
+                stepper.set_position(0);
+                printf("Syringe refilled, plunger position zeroed\n");
+            }
+        } else if (!stepper.is_enabled() && gpio_get(F_BUTTON)) {
+            // Pressing MISC while holding F, with the stepper disabled, aborts a paused job so the next one starts from the first pad.
+            if (job_running) {
+                printf("Connot abort a job while it is running!\n");
+            } else if (paused) {
+                next_pad = 0;
+                paused = false;
+                gpio_put(LED1_PIN, 0);
+                gpio_put(LED2_PIN, 0);
+                printf("Paused job aborted\n");
+            } else {
+                printf("No paused job to abort\n");
+            }
+        } else if (stepper.is_enabled()) {
             printf("Stepper disabled\n");
             stepper.disable();
         } else {
@@ -121,6 +166,17 @@ void gpio_callback(uint gpio, uint32_t events)
 }
 
 
+// Function to pause the job, which then waits for the I2C button to be pressed to resume it.
+// While paused, LED 1 blinks with LED 2 off, so it can't be confused with the other LED states.
+void pause_job(void)
+{
+    start = false;
+    paused = true;
+    gpio_put(LED1_PIN, 1);
+    gpio_put(LED2_PIN, 0);
+}
+
+
 // Function for sending Z control commands.
 void control_z(uint32_t z_micron_pos, bool apply_paste) {
     uint8_t z_data[sizeof(z_micron_pos)+1];
@@ -140,7 +196,7 @@ void control_z(uint32_t z_micron_pos, bool apply_paste) {
     } else if (z_response_data[0] == 1 && apply_paste) {
         printf("Z arm is now in position! Applying paste\n");
         z_arm_in_position = true;
-        stepper.forward_by(15);
+        stepper.forward_by(DISPENSE_STEPS);
     } else if (z_response_data[0] == 1 && !apply_paste) {
         printf("Z arm is now in position!\n");
         z_arm_in_position = true;
@@ -248,25 +304,64 @@ int main(void)
     gpio_set_irq_enabled(MISC_BUTTON, GPIO_IRQ_EDGE_RISE, true);
 
 
+    if (stepper.is_position_valid()) {
+        printf("Plunger position is %d steps, %d steps left in syringe\n", (int)stepper.get_position(), remaining_steps());
+    } else {
+        printf("Plunger position is unknown, refill the syringe and zero it before starting\n");
+    }
+
+
     // Loop forever.
     while (true) {
         printf("Working...\n");
         sleep_ms(1000);
+        if (paused) {
+            gpio_put(LED1_PIN, !gpio_get(LED1_PIN));
+        }
         if (start && currently_master) {
+            // Check the syringe level here rather than on the I2C button, so jobs started by a mastership handover are checked too.
+            if (!stepper.is_position_valid()) {
+                // Should not start if we don't know how much paste is left, e.g. after a power cycle.
+                printf("Connot start! Plunger position is unknown, refill the syringe and zero it first!\n");
+                pause_job();
+                continue;
+            } else if (remaining_steps() < required_steps()) {
+                // Should not start if there is not enough paste left to finish the board.
+                printf("Connot start! Syringe has %d steps left, but %d are needed!\n", remaining_steps(), required_steps());
+                pause_job();
+                continue;
+            }
+
             printf("Starting!\n");
+            job_running = true;
 
-            // Iterate over array of xy positions for paste application.
-            // Number of iterations is calculated by dividing the total number of bytes in the array by 8,
+            // Iterate over array of xy positions for paste application, starting from where a paused job left off.
+            // Number of pads is calculated by dividing the total number of bytes in the array by 8,
             // since each sub-array containing xy coordinates is 8 bytes in size (4 bytes for each 32 bit coordinate)
-            for (int i=0; i<(sizeof(xy_coords)/sizeof(xy_coords[0])); i++) {
+            for (; next_pad<NUM_PADS; next_pad++) {
+                // Pause before this pad if there isn't enough paste left for it. Z is already raised at this point.
+                if (remaining_steps() < DISPENSE_STEPS) {
+                    break;
+                }
+
                 // Move XY into correct position.
-                control_xy(xy_coords[i][0] + X_OFFSET, xy_coords[i][1] + Y_OFFSET);
+                control_xy(xy_coords[next_pad][0] + X_OFFSET, xy_coords[next_pad][1] + Y_OFFSET);
 
                 // Move Z down, apply paste, move Z back up.
                 control_z(Z_DROP_POS, true);  // False for testing.
                 sleep_ms(2000);
                 control_z(Z_RISE_POS, false);
             }
+            job_running = false;
+
+            if (next_pad < NUM_PADS) {
+                // Keep mastership and wait for the syringe to be refilled, then resume with the I2C button.
+                printf("Paused at pad %u of %u! Syringe has %d steps left, refill and press start to resume\n",
+                next_pad, (uint)NUM_PADS, remaining_steps());
+                pause_job();
+                continue;
+            }
+            next_pad = 0;
 
             // We are finished with paste application now, so reset XYZ position and handover mastership.
             printf("Finished with paste application, resetting to 0, 0, 0 XYZ\n");